@@ -3,6 +3,29 @@
 #include <fstream>
 #include <cmath>
 #include <algorithm>
+#include <sstream>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <ctime>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 using namespace std;
 
 //***************************************************************************************************//
@@ -18,19 +41,306 @@ struct Pixel
     int blue;
 };
 
+// BMP header fields needed to locate pixel data
+struct BmpHeader
+{
+    long long file_size;        // As stored, 0 or wrong in some files over 4 GB
+    long long start;            // Offset of the pixel array
+    int header_size;            // DIB header size, 40 or more (108 for V4, 124 for V5)
+    int width;
+    int height;                 // Always positive, see top_down
+    bool top_down;              // True if rows are stored from the top, a negative height in the file
+    int bits_per_pixel;         // 24 or 32
+    int compression;            // 0 (BI_RGB) or 3 (BI_BITFIELDS)
+    int red_byte;               // Byte of each pixel holding red
+    int green_byte;
+    int blue_byte;
+    long long scanline_size;    // Bytes of pixel data per row, without padding
+    long long padding;          // Bytes of padding at the end of each row
+};
+
+// One image processing step and the parameters it was given
+struct Operation
+{
+    int selection;      // Menu number of the process, 1 to 10
+    double factor;      // Scaling factor for processes 2, 8 and 9
+    int number;         // Multiple of 90 degrees for process 5
+    int x_scale;        // Width factor for process 6
+    int y_scale;        // Height factor for process 6
+};
+
+// Fixed-capacity queue connecting the stages of the batch pipeline.
+// push() blocks while the queue is full, which holds back a stage that
+// runs ahead of the one after it.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    // Adds an item, waiting for room. Returns false if the queue was closed.
+    bool push(T item)
+    {
+        unique_lock<mutex> lock(guard);
+        not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Removes the oldest item, waiting for one. Returns false once the queue is closed and empty.
+    bool pop(T& item)
+    {
+        unique_lock<mutex> lock(guard);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Wakes all waiting stages. Items already queued can still be popped.
+    void close()
+    {
+        lock_guard<mutex> lock(guard);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    mutex guard;
+    condition_variable not_empty;
+    condition_variable not_full;
+};
+
+// Per-worker counters reported by WorkStealingPool
+struct WorkerStats
+{
+    long long tasks;        // Tasks run by the worker
+    long long stolen;       // Tasks taken from another worker's queue
+    double busy_seconds;    // Time spent running tasks
+};
+
+// Thread pool where each worker has its own task queue. A worker runs the
+// newest task from its own queue and, when that is empty, steals the oldest
+// task from another worker. Tasks may submit subtasks and wait for them with
+// help_until(), which keeps the waiting worker running other tasks.
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(int worker_count) : stopping(false), queued(0), next_queue(0)
+    {
+        start_time = chrono::steady_clock::now();
+        for (int i = 0; i < worker_count; i++)
+        {
+            workers.emplace_back(new Worker());
+        }
+        for (int i = 0; i < worker_count; i++)
+        {
+            threads.emplace_back([this, i] { worker_loop(i); });
+        }
+    }
+
+    // Runs every queued task, then stops the workers
+    ~WorkStealingPool()
+    {
+        {
+            lock_guard<mutex> lock(sleep_guard);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& t : threads)
+        {
+            t.join();
+        }
+    }
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+    // Queues a task, on the caller's own queue when called from a worker
+    void submit(function<void()> task)
+    {
+        int index = current_worker;
+        if (index < 0)
+        {
+            index = next_queue++ % workers.size();
+        }
+        {
+            lock_guard<mutex> lock(workers[index]->guard);
+            workers[index]->tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> lock(sleep_guard);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    // Checks whether the calling thread is one of the workers
+    bool on_worker() const
+    {
+        return current_worker >= 0;
+    }
+
+    // Waits until done() is true. Workers run queued tasks while they wait,
+    // so a task waiting on its own subtasks never blocks the pool.
+    void help_until(const function<bool()>& done)
+    {
+        while (!done())
+        {
+            if (current_worker < 0 || !run_one(current_worker))
+            {
+                this_thread::sleep_for(chrono::microseconds(100));
+            }
+        }
+    }
+
+    // Gets the counters of each worker
+    vector<WorkerStats> stats()
+    {
+        vector<WorkerStats> result;
+        for (const unique_ptr<Worker>& worker : workers)
+        {
+            lock_guard<mutex> lock(worker->guard);
+            result.push_back(worker->stats);
+        }
+        return result;
+    }
+
+    // Gets the seconds since the pool started
+    double elapsed_seconds() const
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    }
+
+private:
+    struct Worker
+    {
+        deque<function<void()>> tasks;
+        mutex guard;
+        WorkerStats stats = {0, 0, 0.0};
+    };
+
+    // Takes one task, from the back of the worker's own queue or the front of another's,
+    // and runs it. Returns false if every queue was empty.
+    bool run_one(int index)
+    {
+        function<void()> task;
+        bool stolen = false;
+        {
+            lock_guard<mutex> lock(workers[index]->guard);
+            if (!workers[index]->tasks.empty())
+            {
+                task = move(workers[index]->tasks.back());
+                workers[index]->tasks.pop_back();
+            }
+        }
+        for (size_t i = 1; !task && i < workers.size(); i++)
+        {
+            Worker& victim = *workers[(index + i) % workers.size()];
+            lock_guard<mutex> lock(victim.guard);
+            if (!victim.tasks.empty())
+            {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                stolen = true;
+            }
+        }
+        if (!task)
+        {
+            return false;
+        }
+        queued--;
+
+        // Only count time at the outermost task, nested tasks run inside it
+        depth++;
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        task();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        depth--;
+
+        lock_guard<mutex> lock(workers[index]->guard);
+        workers[index]->stats.tasks++;
+        workers[index]->stats.stolen += stolen ? 1 : 0;
+        if (depth == 0)
+        {
+            workers[index]->stats.busy_seconds += seconds;
+        }
+        return true;
+    }
+
+    void worker_loop(int index)
+    {
+        current_worker = index;
+        while (true)
+        {
+            if (run_one(index))
+            {
+                continue;
+            }
+            unique_lock<mutex> lock(sleep_guard);
+            wake.wait(lock, [this] { return queued > 0 || stopping; });
+            if (stopping && queued <= 0)
+            {
+                return;
+            }
+        }
+    }
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    bool stopping;
+    atomic<int> queued;             // Tasks submitted and not yet started
+    atomic<unsigned> next_queue;    // Round robin queue for tasks from outside the pool
+    mutex sleep_guard;
+    condition_variable wake;
+    chrono::steady_clock::time_point start_time;
+
+    static thread_local int current_worker;     // Index of the worker running this thread, or -1
+    static thread_local int depth;              // Tasks nested on this thread
+};
+
+thread_local int WorkStealingPool::current_worker = -1;
+thread_local int WorkStealingPool::depth = 0;
+
+// One file moving through the batch pipeline
+struct BatchItem
+{
+    string input;
+    string output;
+    vector<vector<Pixel>> image;    // Empty if the file could not be read
+    string cache_key;               // Empty if results are not cached
+    bool cached;                    // True if the output was served from the cache
+};
+
 /**
- * Gets an integer from a binary stream.
+ * Gets an unsigned integer from a binary stream.
  * Helper function for read_image()
  * @param stream the stream
  * @param offset the offset at which to read the integer
- * @param bytes  the number of bytes to read
+ * @param bytes  the number of bytes to read, at most 4
  * @return the integer starting at the given offset
  */ 
-int get_int(fstream& stream, int offset, int bytes)
+long long get_int(fstream& stream, long long offset, int bytes)
 {
     stream.seekg(offset);
-    int result = 0;
-    int base = 1;
+    long long result = 0;
+    long long base = 1;
     for (int i = 0; i < bytes; i++)
     {   
         result = result + stream.get() * base;
@@ -40,70 +350,241 @@ int get_int(fstream& stream, int offset, int bytes)
 }
 
 /**
- * Reads the BMP image specified and returns the resulting image as a vector
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Gets the byte of a pixel that a 32-bit channel mask selects
+ * Helper function for read_bmp_header()
+ * @param mask the channel mask
+ * @return the byte index, or -1 if the mask is not exactly one whole byte
  */
-vector<vector<Pixel>> read_image(string filename)
+int mask_byte(long long mask)
 {
-    // Open the binary file
-    fstream stream;
-    stream.open(filename, ios::in | ios::binary);
+    for (int i = 0; i < 4; i++)
+    {
+        if (mask == 0xFFLL << (8 * i))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Reads and validates the BMP and DIB headers of an open stream.
+ * Every size is checked against the real file length with 64-bit arithmetic,
+ * so a header can never make a reader go past the end of the file.
+ * Helper function for read_image() and the region functions
+ * @param stream the stream
+ * @param header the header fields to fill in
+ * @return True if this is a supported image and false otherwise
+ */
+bool read_bmp_header(fstream& stream, BmpHeader& header)
+{
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.seekg(0, ios::end);
+    long long actual_size = stream.tellg();
+    if (actual_size < 54 || get_int(stream, 0, 2) != 'B' + 256 * 'M')
+    {
+        return false;
+    }
 
     // Get the image properties
-    int file_size = get_int(stream, 2, 4);
-    int start = get_int(stream, 10, 4);
-    int width = get_int(stream, 18, 4);
-    int height = get_int(stream, 22, 4);
-    int bits_per_pixel = get_int(stream, 28, 2);
+    header.file_size = get_int(stream, 2, 4);
+    header.start = get_int(stream, 10, 4);
+    header.header_size = get_int(stream, 14, 4);
+    long long width = get_int(stream, 18, 4);
+    long long height = get_int(stream, 22, 4);
+    header.bits_per_pixel = get_int(stream, 28, 2);
+    header.compression = get_int(stream, 30, 4);
+
+    // A negative height means the rows are stored from top to bottom
+    if (height >= 1LL << 31)
+    {
+        height = height - (1LL << 32);
+    }
+    header.top_down = height < 0;
+    height = llabs(height);
+    if (width <= 0 || width > INT_MAX || height <= 0 || height > INT_MAX)
+    {
+        return false;
+    }
+    header.width = width;
+    header.height = height;
+
+    // Default byte order within a pixel is blue, green, red (then alpha or unused)
+    header.blue_byte = 0;
+    header.green_byte = 1;
+    header.red_byte = 2;
+    if (header.bits_per_pixel == 32 && header.compression == 3)
+    {
+        // BI_BITFIELDS: the channel masks follow a 40 byte header, or are part of a V4 or V5 header
+        header.red_byte = mask_byte(get_int(stream, 54, 4));
+        header.green_byte = mask_byte(get_int(stream, 58, 4));
+        header.blue_byte = mask_byte(get_int(stream, 62, 4));
+        if (header.red_byte < 0 || header.green_byte < 0 || header.blue_byte < 0)
+        {
+            return false;
+        }
+    }
+    else if ((header.bits_per_pixel != 24 && header.bits_per_pixel != 32) || header.compression != 0)
+    {
+        return false;
+    }
+    if (header.header_size < 40 || header.start < 14 + header.header_size || !stream)
+    {
+        return false;
+    }
 
     // Scan lines must occupy multiples of four bytes
-    int scanline_size = width * (bits_per_pixel / 8);
-    int padding = 0;
-    if (scanline_size % 4 != 0)
+    header.scanline_size = width * (header.bits_per_pixel / 8);
+    header.padding = 0;
+    if (header.scanline_size % 4 != 0)
     {
-        padding = 4 - scanline_size % 4;
+        header.padding = 4 - header.scanline_size % 4;
     }
 
-    // Return empty vector if this is not a valid image
-    if (file_size != start + (scanline_size + padding) * height)
+    // The pixel array must fit in the file. The 32-bit size field cannot describe
+    // files over 4 GB, so the real file length is checked instead.
+    long long stride = header.scanline_size + header.padding;
+    return stride <= (actual_size - header.start) / height;
+}
+
+/**
+ * Gets the file position of the first byte of an image row.
+ * BMP rows are fixed-stride, so any row can be seeked to directly.
+ * @param header the image header
+ * @param row    the row index, counted from the top of the image
+ * @return the file offset of the row
+ */
+long long bmp_row_position(const BmpHeader& header, int row)
+{
+    // Note: BMP files store pixels from bottom to top, unless the height is negative
+    long long stride = header.scanline_size + header.padding;
+    if (header.top_down)
     {
-        return {};
+        return header.start + stride * row;
     }
+    return header.start + stride * (header.height - 1 - row);
+}
 
-    // Create a vector the size of the input image
-    vector<vector<Pixel>> image(height, vector<Pixel> (width));
-
-    int pos = start;
-    // For each row, starting from the last row to the first
-    // Note: BMP files store pixels from bottom to top
-    for (int i = height - 1; i >= 0; i--)
+/**
+ * Converts the stored bytes of consecutive pixels to Pixels
+ * Helper function for read_image() and read_image_region()
+ * @param data   the pixel bytes
+ * @param header the image header
+ * @param pixels the pixels to fill in
+ * @param count  the number of pixels
+ */
+void decode_pixels(const unsigned char* data, const BmpHeader& header, Pixel* pixels, int count)
+{
+    int pixel_bytes = header.bits_per_pixel / 8;
+    for (int j = 0; j < count; j++)
     {
-        // For each column
-        for (int j = 0; j < width; j++)
-        {
-            // Go to the pixel position
-            stream.seekg(pos);
+        pixels[j].blue = data[header.blue_byte];
+        pixels[j].green = data[header.green_byte];
+        pixels[j].red = data[header.red_byte];
+        data = data + pixel_bytes;
+    }
+}
 
-            // Save the pixel values to the image vector
-            // Note: BMP files store pixels in blue, green, red order
-            image[i][j].blue = stream.get();
-            image[i][j].green = stream.get();
-            image[i][j].red = stream.get();
+/**
+ * Reads and converts a range of rows of a BMP image
+ * Helper function for read_image(), one call runs on each decoding thread
+ * @param filename BMP image filename
+ * @param header   the image header
+ * @param image    the image, with a row for every image row
+ * @param first    the first row to read
+ * @param last     one past the last row to read
+ * @return True if successful and false otherwise
+ */
+bool decode_rows(string filename, const BmpHeader& header, vector<vector<Pixel>>& image, int first, int last)
+{
+    // Each thread has its own stream, so reads do not wait for each other
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
 
-            // We are ignoring the alpha channel if there is one
+    // Read several rows at a time, up to about 4 MB
+    long long stride = header.scanline_size + header.padding;
+    int chunk_rows = max(1LL, (4LL << 20) / stride);
+    vector<unsigned char> buffer;
 
-            // Advance the position to the next pixel
-            pos = pos + (bits_per_pixel / 8);
+    for (int chunk_first = first; chunk_first < last; chunk_first = chunk_first + chunk_rows)
+    {
+        int chunk_last = min(last, chunk_first + chunk_rows);
+        int count = chunk_last - chunk_first;
+
+        // The rows of a chunk are contiguous in the file, in reverse order for bottom-up images
+        int lowest_row = header.top_down ? chunk_first : chunk_last - 1;
+        buffer.resize(stride * count);
+        stream.seekg(bmp_row_position(header, lowest_row));
+        stream.read((char*)buffer.data(), buffer.size());
+        if (!stream)
+        {
+            return false;
         }
 
-        // Skip the padding at the end of each row
-        stream.seekg(padding, ios::cur);
-        pos = pos + padding;
+        for (int k = 0; k < count; k++)
+        {
+            int row = header.top_down ? chunk_first + k : chunk_last - 1 - k;
+            image[row].resize(header.width);
+            decode_pixels(buffer.data() + stride * k, header, image[row].data(), header.width);
+        }
     }
+    return true;
+}
+
+/**
+ * Reads the BMP image specified and returns the resulting image as a vector.
+ * Large images are decoded by several threads, each converting its own range of rows.
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> read_image(string filename)
+{
+    // Open the binary file
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
 
-    // Close the stream and return the image vector
+    // Return empty vector if this is not a valid image
+    BmpHeader header;
+    if (!read_bmp_header(stream, header))
+    {
+        return {};
+    }
     stream.close();
+
+    // Rows are allocated by the thread that decodes them
+    vector<vector<Pixel>> image(header.height);
+
+    // Use one thread per 16 MB of pixel data, up to one per core
+    long long array_bytes = (header.scanline_size + header.padding) * header.height;
+    int thread_count = min((long long)max(1u, thread::hardware_concurrency()), array_bytes / (16LL << 20) + 1);
+    thread_count = min(thread_count, header.height);
+
+    vector<thread> threads;
+    vector<char> succeeded(thread_count);
+    for (int t = 0; t < thread_count; t++)
+    {
+        int first = (long long)header.height * t / thread_count;
+        int last = (long long)header.height * (t + 1) / thread_count;
+        threads.emplace_back([&, t, first, last] {
+            succeeded[t] = decode_rows(filename, header, image, first, last);
+        });
+    }
+    for (thread& t : threads)
+    {
+        t.join();
+    }
+
+    if (find(succeeded.begin(), succeeded.end(), 0) != succeeded.end())
+    {
+        return {};
+    }
     return image;
 }
 
@@ -117,7 +598,7 @@ vector<vector<Pixel>> read_image(string filename)
  * @param value  Value to set
  * @return nothing
  */
-void set_bytes(unsigned char arr[], int offset, int bytes, int value)
+void set_bytes(unsigned char arr[], int offset, int bytes, long long value)
 {
     for (int i = 0; i < bytes; i++)
     {
@@ -126,35 +607,23 @@ void set_bytes(unsigned char arr[], int offset, int bytes, int value)
 }
 
 /**
- * Write the input image to a BMP file name specified
- * @param filename The BMP file name to save the image to
- * @param image    The input image to save
- * @return True if successful and false otherwise
+ * Writes the BMP and DIB headers for a 24-bit image
+ * Helper function for write_image() and create_blank_image()
+ * @param stream        The stream to write to
+ * @param width_pixels  The image width in pixels
+ * @param height_pixels The image height in pixels
+ * @return the size of the pixel array in bytes, including padding
  */
-bool write_image(string filename, const vector<vector<Pixel>>& image)
+long long write_bmp_header(fstream& stream, int width_pixels, int height_pixels)
 {
-    // Get the image width and height in pixels
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
-
     // Calculate the width in bytes incorporating padding (4 byte alignment)
-    int width_bytes = width_pixels * 3;
+    long long width_bytes = width_pixels * 3LL;
     int padding_bytes = 0;
     padding_bytes = (4 - width_bytes % 4) % 4;
     width_bytes = width_bytes + padding_bytes;
 
     // Pixel array size in bytes, including padding
-    int array_bytes = width_bytes * height_pixels;
-
-    // Open a file stream for writing to a binary file
-    fstream stream;
-    stream.open(filename, ios::out | ios::binary);
-
-    // If there was a problem opening the file, return false
-    if (!stream.is_open())
-    {
-        return false;
-    }
+    long long array_bytes = width_bytes * height_pixels;
 
     // Create the BMP and DIB Headers
     const int BMP_HEADER_SIZE = 14;
@@ -162,10 +631,18 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
     unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
     unsigned char dib_header[DIB_HEADER_SIZE] = {0};
 
+    // Sizes over 4 GB do not fit their fields, readers use the real file length instead
+    long long file_size = BMP_HEADER_SIZE + DIB_HEADER_SIZE + array_bytes;
+    if (file_size > 0xFFFFFFFFLL)
+    {
+        file_size = 0;
+        array_bytes = 0;
+    }
+
     // BMP Header
     set_bytes(bmp_header,  0, 1, 'B');              // ID field
     set_bytes(bmp_header,  1, 1, 'M');              // ID field
-    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
+    set_bytes(bmp_header,  2, 4, file_size);        // Size of BMP file
     set_bytes(bmp_header,  6, 2, 0);                // Reserved
     set_bytes(bmp_header,  8, 2, 0);                // Reserved
     set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
@@ -186,10 +663,40 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
     // Write the BMP and DIB Headers to the file
     stream.write((char*)bmp_header, sizeof(bmp_header));
     stream.write((char*)dib_header, sizeof(dib_header));
+    return width_bytes * height_pixels;
+}
+
+/**
+ * Write the input image to a BMP file name specified
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const vector<vector<Pixel>>& image)
+{
+    // Get the image width and height in pixels
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Rows are padded to a multiple of 4 bytes
+    long long width_bytes = width_pixels * 3LL;
+    width_bytes = width_bytes + (4 - width_bytes % 4) % 4;
+
+    // Open a file stream for writing to a binary file
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+
+    // If there was a problem opening the file, return false
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    // Write the BMP and DIB Headers to the file
+    write_bmp_header(stream, width_pixels, height_pixels);
 
-    // Initialize pixel and padding
-    unsigned char pixel[3] = {0};
-    unsigned char padding[3] = {0};
+    // Each row is built in a buffer and written at once, padding bytes stay zero
+    vector<unsigned char> row_bytes(width_bytes, 0);
 
     // Pixel Array (Left to right, bottom to top, with padding)
     for (int h = height_pixels - 1; h >= 0; h--)
@@ -197,42 +704,260 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
         for (int w = 0; w < width_pixels; w++)
         {
             // Write the pixel (Blue, Green, Red)
-            pixel[0] = image[h][w].blue;
-            pixel[1] = image[h][w].green;
-            pixel[2] = image[h][w].red;
-            stream.write((char*)pixel, 3);
+            row_bytes[w * 3LL] = image[h][w].blue;
+            row_bytes[w * 3LL + 1] = image[h][w].green;
+            row_bytes[w * 3LL + 2] = image[h][w].red;
         }
-        // Write the padding bytes
-        stream.write((char *)padding, padding_bytes);
+        stream.write((char*)row_bytes.data(), row_bytes.size());
     }
 
-    // Close the stream and return true
+    // Close the stream and return whether every write succeeded
     stream.close();
-    return true;
+    return !stream.fail();
 }
 
 //***************************************************************************************************//
-//                                Func definitions                                  //
+//                                Region of interest                                  //
 //***************************************************************************************************//
 
+/**
+ * Reads only the rows and byte ranges of a BMP image that cover a rectangle
+ * @param filename BMP image filename
+ * @param x        left column of the region
+ * @param y        top row of the region
+ * @param width    width of the region in pixels
+ * @param height   height of the region in pixels
+ * @return the region as a vector of vector of Pixels, empty if the region does not fit the image
+ */
+vector<vector<Pixel>> read_image_region(string filename, int x, int y, int width, int height)
+{
+    // Open the binary file
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+
+    BmpHeader header;
+    if (!read_bmp_header(stream, header))
+    {
+        return {};
+    }
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+        x > header.width - width || y > header.height - height)
+    {
+        return {};
+    }
+
+    int pixel_bytes = header.bits_per_pixel / 8;
+    vector<unsigned char> row_bytes((long long)width * pixel_bytes);
+    vector<vector<Pixel>> region(height, vector<Pixel> (width));
+
+    for (int i = 0; i < height; i++)
+    {
+        // Seek straight to the first pixel of the region in this row
+        stream.seekg(bmp_row_position(header, y + i) + (long long)x * pixel_bytes);
+        stream.read((char*)row_bytes.data(), row_bytes.size());
+        if (!stream)
+        {
+            return {};
+        }
+
+        decode_pixels(row_bytes.data(), header, region[i].data(), width);
+    }
+
+    stream.close();
+    return region;
+}
+
+/**
+ * Overwrites a rectangle of an existing BMP file, patching rows in place.
+ * Pixels outside the rectangle, and any alpha channel, are left untouched.
+ * @param filename The existing BMP file to patch
+ * @param region   The pixels to write
+ * @param x        left column of the region
+ * @param y        top row of the region
+ * @return True if successful and false otherwise
+ */
+bool write_image_region(string filename, const vector<vector<Pixel>>& region, int x, int y)
+{
+    if (region.empty() || region[0].empty())
+    {
+        return false;
+    }
+    int width = region[0].size();
+    int height = region.size();
+
+    // Open for reading and writing so the rest of the file is preserved
+    fstream stream;
+    stream.open(filename, ios::in | ios::out | ios::binary);
+
+    BmpHeader header;
+    if (!read_bmp_header(stream, header))
+    {
+        return false;
+    }
+    if (x < 0 || y < 0 || x > header.width - width || y > header.height - height)
+    {
+        return false;
+    }
+
+    int pixel_bytes = header.bits_per_pixel / 8;
+    vector<unsigned char> row_bytes((long long)width * pixel_bytes);
+
+    for (int i = 0; i < height; i++)
+    {
+        long long pos = bmp_row_position(header, y + i) + (long long)x * pixel_bytes;
+
+        // Keep the existing bytes when there is an alpha channel to preserve
+        if (pixel_bytes > 3)
+        {
+            stream.seekg(pos);
+            stream.read((char*)row_bytes.data(), row_bytes.size());
+        }
+
+        for (int j = 0; j < width; j++)
+        {
+            long long pixel = (long long)j * pixel_bytes;
+            row_bytes[pixel + header.blue_byte] = region[i][j].blue;
+            row_bytes[pixel + header.green_byte] = region[i][j].green;
+            row_bytes[pixel + header.red_byte] = region[i][j].red;
+        }
+
+        stream.seekp(pos);
+        stream.write((char*)row_bytes.data(), row_bytes.size());
+        if (!stream)
+        {
+            return false;
+        }
+    }
+
+    stream.close();
+    return true;
+}
+
+/**
+ * Creates a 24-bit BMP file of the given size with every pixel black.
+ * The pixel array is not written, so most filesystems store it sparsely
+ * until rows are filled in with write_image_region().
+ * @param filename      The BMP file name to create
+ * @param width_pixels  The image width in pixels
+ * @param height_pixels The image height in pixels
+ * @return True if successful and false otherwise
+ */
+bool create_blank_image(string filename, int width_pixels, int height_pixels)
+{
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    long long array_bytes = write_bmp_header(stream, width_pixels, height_pixels);
+
+    // Extend the file to its full size by writing its last byte
+    if (array_bytes > 0)
+    {
+        stream.seekp(array_bytes - 1, ios::cur);
+        stream.put(0);
+    }
+
+    return !stream.fail();
+}
+
+/**
+ * Checks whether two paths name the same existing file
+ * @param first  the first path
+ * @param second the second path
+ * @return True if both exist and are the same file
+ */
+bool same_file(string first, string second)
+{
+    struct stat first_info;
+    struct stat second_info;
+    return stat(first.c_str(), &first_info) == 0 && stat(second.c_str(), &second_info) == 0 &&
+           first_info.st_dev == second_info.st_dev && first_info.st_ino == second_info.st_ino;
+}
+
+/**
+ * Copies a file byte for byte
+ * @param source      The file to copy
+ * @param destination The file to create or overwrite
+ * @return True if successful and false otherwise, including when both name the same file
+ */
+bool copy_file(string source, string destination)
+{
+    // Opening the destination would truncate the source before it is read
+    if (same_file(source, destination))
+    {
+        return false;
+    }
+
+    fstream in;
+    fstream out;
+    in.open(source, ios::in | ios::binary);
+    out.open(destination, ios::out | ios::binary);
+    if (!in.is_open() || !out.is_open())
+    {
+        return false;
+    }
+
+    vector<char> buffer(1 << 20);
+    while (in)
+    {
+        in.read(buffer.data(), buffer.size());
+        out.write(buffer.data(), in.gcount());
+    }
+
+    return !out.fail();
+}
+
+/**
+ * Lists the names of the files in a directory
+ * @param directory the directory
+ * @return the names, sorted, without . and ..
+ */
+vector<string> list_directory(string directory)
+{
+    vector<string> names;
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr)
+    {
+        return names;
+    }
+    struct dirent* item;
+    while ((item = readdir(dir)) != nullptr)
+    {
+        string name = item->d_name;
+        if (name != "." && name != "..")
+        {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+    return names;
+}
+
+//***************************************************************************************************//
+//                                Func definitions                                  //
+//***************************************************************************************************//
+
+
+//
+// helper function - gets image dimensions 
 
-//
-// helper function - gets image dimensions 
-
 
  // process 1 - update : working 12/12/23
-    vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image){
+ // image[0] holds row offset of an image total_rows tall, rows first to last are produced
+    vector<vector<Pixel>> process_1_rows(const vector<vector<Pixel>>& image, int offset, int first, int last, int total_rows){
     // to get the height and width of the pixels
-    int num_rows = image.size(); // get the height of the 2D vector called image
+    int num_rows = last - first; // rows to produce
     int num_columns = image[0].size(); // Gets the number of columns (i.e. width) in a 2D vector named image
-    int height = num_columns; // alt var name for convenience
-    int width = num_columns; // alt var name
     
     
     // create a new image and prepopulate it
    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));     
     // write a nested for loop that loops thru every pixel value 
-    for (int row = 0;row < num_rows;row++){
+    for (int row = first;row < last;row++){
         for(int col = 0;col < num_columns;col++){
              // perform process 1 on each frame RGB
            
@@ -240,25 +965,29 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
             // int distance = sqrt(pow(row - num_rows/2, 2) + pow(col - num_columns/2, 2));
             // int scaling_factor = (num_rows - distance)/ num_rows;
             
-            int distance = sqrt(pow(row - num_rows/2, 2) + pow(col - num_columns/2, 2));
+            int distance = sqrt(pow(row - total_rows/2, 2) + pow(col - num_columns/2, 2));
 
             // Calculate the scaling factor based on the distance
-            double scaling_factor = double (num_rows - distance) / num_rows;
+            double scaling_factor = double (total_rows - distance) / total_rows;
             
         
-            new_image[row][col].red = image[row][col].red * scaling_factor;
-            new_image[row][col].green = image[row][col].green * scaling_factor;
-            new_image[row][col].blue = image[row][col].blue * scaling_factor;
+            new_image[row - first][col].red = image[row - offset][col].red * scaling_factor;
+            new_image[row - first][col].green = image[row - offset][col].green * scaling_factor;
+            new_image[row - first][col].blue = image[row - offset][col].blue * scaling_factor;
         } 
     }
         return new_image;
     } 
+
+    vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image){
+        return process_1_rows(image, 0, 0, image.size(), image.size());
+    } 
  // end process 1
 
 // process 2 - works correctly 12/12/23
- vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image , double scaling_factor){
+ vector<vector<Pixel>> process_2_rows(const vector<vector<Pixel>>& image, int offset, int first, int last, double scaling_factor){
     // to get the height and width of the pixels
-    int num_rows = image.size(); // get the height of the 2D vector called image
+    int num_rows = last - first; // rows to produce, image[0] holds row offset
     int num_columns = image[0].size(); // Gets the number of columns (i.e. width) in a 2D vector named image
     int height = num_columns; // alt var name for convenience
     int width = num_columns; // alt var name
@@ -267,44 +996,49 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
     // create a new image and prepopulate it
    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));     
     // write a nested for loop that loops thru every pixel value 
-    for (int row = 0;row < num_rows;row++){
+    for (int row = first;row < last;row++){
         for(int col = 0;col < num_columns;col++){
             
            
             // get the R G B vals
-            int red_val = image[row][col].red;
-            int green_val = image[row][col].green;
-            int blue_val = image[row][col].blue;
+            int red_val = image[row - offset][col].red;
+            int green_val = image[row - offset][col].green;
+            int blue_val = image[row - offset][col].blue;
 
             // avg the values
             double avg = (red_val + green_val + blue_val) / 3;
             
             // if the cell is light make it lighter
             if (avg >= 170) {
-                new_image[row][col].red = (255 - (255 - red_val)*scaling_factor);
-                new_image[row][col].green = (255 - (255 - green_val)*scaling_factor);
-                new_image[row][col].blue = (255 - (255 - blue_val)*scaling_factor);
+                new_image[row - first][col].red = (255 - (255 - red_val)*scaling_factor);
+                new_image[row - first][col].green = (255 - (255 - green_val)*scaling_factor);
+                new_image[row - first][col].blue = (255 - (255 - blue_val)*scaling_factor);
             }
             else if(avg< 90) {
-                new_image[row][col].red = red_val *scaling_factor;
-                new_image[row][col].green = green_val*scaling_factor;
-                new_image[row][col].blue =  blue_val*scaling_factor;
+                new_image[row - first][col].red = red_val *scaling_factor;
+                new_image[row - first][col].green = green_val*scaling_factor;
+                new_image[row - first][col].blue =  blue_val*scaling_factor;
             }
             
         else {
-            new_image[row][col].red = image[row][col].red;
-            new_image[row][col].green = image[row][col].green;
-            new_image[row][col].blue = image[row][col].blue;
+            new_image[row - first][col].red = image[row - offset][col].red;
+            new_image[row - first][col].green = image[row - offset][col].green;
+            new_image[row - first][col].blue = image[row - offset][col].blue;
            }
         } 
     }
         return new_image;
-    } 
+    }
+
+ vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor){
+     return process_2_rows(image, 0, 0, image.size(), scaling_factor);
+ } 
 
 // end process 2
 
 // process 3 grayscale working 12/12/23
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image){
+// image[0] holds row offset of an image total_rows tall, rows first to last are produced
+vector<vector<Pixel>> process_3_rows(const vector<vector<Pixel>>& image, int offset, int first, int last, int total_rows){
     const int sobelX[3][3] = {
         {-1, 0, 1},
         {-2, 0, 2},
@@ -317,14 +1051,14 @@ vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image){
         {-1, -2, -1}
     };
 
-    int num_rows = image.size();
+    int num_rows = total_rows;
     int num_columns = image[0].size();
 
     // Create a new image to store the edge-detected result
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+    vector<vector<Pixel>> new_image(last - first, vector<Pixel>(num_columns));
 
     // Apply the Sobel operator while converting to grayscale
-    for (int row = 1; row < num_rows - 1; row++) {
+    for (int row = max(first, 1); row < min(last, num_rows - 1); row++) {
         for (int col = 1; col < num_columns - 1; col++) {
             int gx = 0; // Gradient in x direction
             int gy = 0; // Gradient in y direction
@@ -334,9 +1068,9 @@ vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image){
             for (int i = -1; i <= 1; i++) {
                 for (int j = -1; j <= 1; j++) {
                     // Access the pixel
-                    int red_val = image[row + i][col + j].red;
-                    int green_val = image[row + i][col + j].green;
-                    int blue_val = image[row + i][col + j].blue;
+                    int red_val = image[row + i - offset][col + j].red;
+                    int green_val = image[row + i - offset][col + j].green;
+                    int blue_val = image[row + i - offset][col + j].blue;
 
                     // Calculate the grayscale value
                     gray_val += (red_val + green_val + blue_val) / 3;
@@ -357,33 +1091,41 @@ vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image){
             magnitude = min(255, max(0, magnitude));
 
             // Set the new pixel value in the edge-detected image
-            new_image[row][col].red = magnitude;  // Grayscale value
-            new_image[row][col].green = magnitude;  // Grayscale value
-            new_image[row][col].blue = magnitude;  // Grayscale value
+            new_image[row - first][col].red = magnitude;  // Grayscale value
+            new_image[row - first][col].green = magnitude;  // Grayscale value
+            new_image[row - first][col].blue = magnitude;  // Grayscale value
         }
     }
 
     // Optionally, set the border pixels to black or keep them unchanged
-    for (int row = 0; row < num_rows; row++) {
-        new_image[row][0].red = 0;
-        new_image[row][0].green = 0;
-        new_image[row][0].blue = 0;
-        new_image[row][num_columns - 1].red = 0;
-        new_image[row][num_columns - 1].green = 0;
-        new_image[row][num_columns - 1].blue = 0;
+    for (int row = first; row < last; row++) {
+        new_image[row - first][0].red = 0;
+        new_image[row - first][0].green = 0;
+        new_image[row - first][0].blue = 0;
+        new_image[row - first][num_columns - 1].red = 0;
+        new_image[row - first][num_columns - 1].green = 0;
+        new_image[row - first][num_columns - 1].blue = 0;
     }
     for (int col = 0; col < num_columns; col++) {
-        new_image[0][col].red = 0;
-        new_image[0][col].green = 0;
-        new_image[0][col].blue = 0;
-        new_image[num_rows - 1][col].red = 0;
-        new_image[num_rows - 1][col].green = 0;
-        new_image[num_rows - 1][col].blue = 0;
+        if (first == 0) {
+            new_image[0][col].red = 0;
+            new_image[0][col].green = 0;
+            new_image[0][col].blue = 0;
+        }
+        if (last == num_rows) {
+            new_image[last - 1 - first][col].red = 0;
+            new_image[last - 1 - first][col].green = 0;
+            new_image[last - 1 - first][col].blue = 0;
+        }
     }
 
     return new_image;
     } 
 
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image){
+    return process_3_rows(image, 0, 0, image.size(), image.size());
+}
+
 
 
 // end process 3
@@ -450,9 +1192,10 @@ vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image){
 
 
 // process 6 enlarge image - tested and works 12/12/23
- vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale){
+ // image[0] holds row offset, the enlarged rows of rows first to last are produced
+ vector<vector<Pixel>> process_6_rows(const vector<vector<Pixel>>& image, int offset, int first, int last, int x_scale, int y_scale){
     // to get the height and width of the pixels
-    int original_height = image.size();
+    int original_height = last - first;
     int original_width = image[0].size();
      
     // create new width and height
@@ -463,19 +1206,23 @@ vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image){
     // create a new image and prepopulate it with the new width and height
    vector<vector<Pixel>> new_image(newheight, vector<Pixel> (newwidth));     
     // write a nested for loop that loops thru every pixel value 
-    for (int row = 0;row < newheight;row++){
+    for (int row = first * y_scale;row < last * y_scale;row++){
         for(int col = 0;col < newwidth ;col++){
           // add pixels to each value
             int originalRow = int (row / y_scale);
             int originalCol = int (col / x_scale);
 
             // Assign the pixel value from the original image to the rotated position
-            new_image[row][col] = image[originalRow][originalCol];
+            new_image[row - first * y_scale][col] = image[originalRow - offset][originalCol];
         } 
      }
         return new_image;
     } 
 
+ vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale){
+    return process_6_rows(image, 0, 0, image.size(), x_scale, y_scale);
+ }
+
 
 
 
@@ -484,9 +1231,9 @@ vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image){
 
 
 // process 7 B & W - working 12/12/23
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image){
+vector<vector<Pixel>> process_7_rows(const vector<vector<Pixel>>& image, int offset, int first, int last){
     // to get the height and width of the pixels
-    int num_rows = image.size(); // get the height of the 2D vector called image
+    int num_rows = last - first; // rows to produce, image[0] holds row offset
     int num_columns = image[0].size(); // Gets the number of columns (i.e. width) in a 2D vector named image
     int height = num_columns; // alt var name
     int width = num_columns; // alt var name
@@ -495,44 +1242,48 @@ vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image){
     // create a new image and prepopulate it
    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));     
     // write a nested for loop that loops thru every pixel value 
-    for (int row = 0;row < num_rows;row++){
+    for (int row = first;row < last;row++){
         for(int col = 0;col < num_columns;col++){
             
            
             // get the R G B vals
-            int red_val = image[row][col].red;
-            int green_val = image[row][col].green;
-            int blue_val = image[row][col].blue;
+            int red_val = image[row - offset][col].red;
+            int green_val = image[row - offset][col].green;
+            int blue_val = image[row - offset][col].blue;
 
             // avg the values
              int gray_val = (red_val + green_val + blue_val) / 3;
             
             // if gray val is higher than 255/2 
             if ( gray_val>= 255/2) {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 255;
+                new_image[row - first][col].red = 255;
+                new_image[row - first][col].green = 255;
+                new_image[row - first][col].blue = 255;
                 }   
             else {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 0;
+                new_image[row - first][col].red = 0;
+                new_image[row - first][col].green = 0;
+                new_image[row - first][col].blue = 0;
                }
             
          
        } 
     }
         return new_image;
-    } 
+    }
+
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image){
+    return process_7_rows(image, 0, 0, image.size());
+} 
 
 
 
 // end process 7 
 
 // process 8 lighten by a scaling factor - tested: working 12/12/23
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor){
+vector<vector<Pixel>> process_8_rows(const vector<vector<Pixel>>& image, int offset, int first, int last, double scaling_factor){
     // to get the height and width of the pixels
-    int num_rows = image.size(); // get the height of the 2D vector called image
+    int num_rows = last - first; // rows to produce, image[0] holds row offset
     int num_columns = image[0].size(); // Gets the number of columns (i.e. width) in a 2D vector named image
     int height = num_columns; // alt var name
     int width = num_columns; // alt var name
@@ -541,32 +1292,36 @@ vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scali
     // create a new image and prepopulate it
    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));     
     // write a nested for loop that loops thru every pixel value 
-    for (int row = 0;row < num_rows;row++){
+    for (int row = first;row < last;row++){
         for(int col = 0;col < num_columns;col++){
             
            
             // get the R G B vals
-            int red_val = image[row][col].red;
-            int green_val = image[row][col].green;
-            int blue_val = image[row][col].blue;
+            int red_val = image[row - offset][col].red;
+            int green_val = image[row - offset][col].green;
+            int blue_val = image[row - offset][col].blue;
             
             // set new vals 
-            new_image[row][col].red = (255 - (255 - red_val)*scaling_factor);
-            new_image[row][col].green = (255 - (255 - green_val)*scaling_factor);
-            new_image[row][col].blue = (255 - (255 - blue_val)*scaling_factor);
+            new_image[row - first][col].red = (255 - (255 - red_val)*scaling_factor);
+            new_image[row - first][col].green = (255 - (255 - green_val)*scaling_factor);
+            new_image[row - first][col].blue = (255 - (255 - blue_val)*scaling_factor);
          } 
       }
         return new_image;
-    } 
+    }
+
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor){
+    return process_8_rows(image, 0, 0, image.size(), scaling_factor);
+} 
 
 
 
 // end process 8 
 
 // start process 9 darken by a scaling factor tested:working - 12/12/23
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor){
+vector<vector<Pixel>> process_9_rows(const vector<vector<Pixel>>& image, int offset, int first, int last, double scaling_factor){
     // to get the height and width of the pixels
-    int num_rows = image.size(); // get the height of the 2D vector called image
+    int num_rows = last - first; // rows to produce, image[0] holds row offset
     int num_columns = image[0].size(); // Gets the number of columns (i.e. width) in a 2D vector named image
     int height = num_columns; // alt var name
     int width = num_columns; // alt var name
@@ -575,31 +1330,35 @@ vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scali
     // create a new image and prepopulate it
    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));     
     // write a nested for loop that loops thru every pixel value 
-    for (int row = 0;row < num_rows;row++){
+    for (int row = first;row < last;row++){
         for(int col = 0;col < num_columns;col++){
             
            
             // get the R G B vals
-            int red_val = image[row][col].red;
-            int green_val = image[row][col].green;
-            int blue_val = image[row][col].blue;
+            int red_val = image[row - offset][col].red;
+            int green_val = image[row - offset][col].green;
+            int blue_val = image[row - offset][col].blue;
             
             //  set new vals
-            new_image[row][col].red =red_val * scaling_factor;
-            new_image[row][col].green = green_val *scaling_factor ;
-            new_image[row][col].blue = blue_val * scaling_factor ;
+            new_image[row - first][col].red =red_val * scaling_factor;
+            new_image[row - first][col].green = green_val *scaling_factor ;
+            new_image[row - first][col].blue = blue_val * scaling_factor ;
          } 
       }
         return new_image;
-    } 
+    }
+
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor){
+    return process_9_rows(image, 0, 0, image.size(), scaling_factor);
+} 
 
 // end process 9 
 
 
 // start process 10  W B R G B - working 12/12/23
- vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image){
+ vector<vector<Pixel>> process_10_rows(const vector<vector<Pixel>>& image, int offset, int first, int last){
     // to get the height and width of the pixels
-    int num_rows = image.size(); // get the height of the 2D vector called image
+    int num_rows = last - first; // rows to produce, image[0] holds row offset
     int num_columns = image[0].size(); // Gets the number of columns (i.e. width) in a 2D vector named image
     int height = num_columns; // alt var name for convenience
     int width = num_columns; // alt var name
@@ -608,110 +1367,1821 @@ vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scali
     // create a new image and prepopulate it
    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));     
     // write a nested for loop that loops thru every pixel value 
-    for (int row = 0;row < num_rows;row++){
+    for (int row = first;row < last;row++){
         for(int col = 0;col < num_columns;col++){
             
            
             // get the R G B vals
-            int red_val = image[row][col].red;
-            int green_val = image[row][col].green;
-            int blue_val = image[row][col].blue;
+            int red_val = image[row - offset][col].red;
+            int green_val = image[row - offset][col].green;
+            int blue_val = image[row - offset][col].blue;
 
             // max color
             int max_color = max({red_val, green_val, blue_val});
             
             // adjust colors
             if (red_val + green_val + blue_val >= 550) {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 255;
+                new_image[row - first][col].red = 255;
+                new_image[row - first][col].green = 255;
+                new_image[row - first][col].blue = 255;
             }
             else if(red_val + green_val + blue_val <= 150) {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue =  0;
+                new_image[row - first][col].red = 0;
+                new_image[row - first][col].green = 0;
+                new_image[row - first][col].blue =  0;
             }
             else if(max_color == red_val) {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue =  0;
+                new_image[row - first][col].red = 255;
+                new_image[row - first][col].green = 0;
+                new_image[row - first][col].blue =  0;
             }
             else if(max_color == green_val) {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue =  0;
+                new_image[row - first][col].red = 0;
+                new_image[row - first][col].green = 255;
+                new_image[row - first][col].blue =  0;
             }
         else {
-            new_image[row][col].red = 0;
-            new_image[row][col].green = 0;
-            new_image[row][col].blue =  255;
+            new_image[row - first][col].red = 0;
+            new_image[row - first][col].green = 0;
+            new_image[row - first][col].blue =  255;
            }
         } 
     }
         return new_image;
-    } 
+    }
+
+ vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image){
+     return process_10_rows(image, 0, 0, image.size());
+ } 
 
 // end process 10
 
 
+/**
+ * Parses an operation written as N or N:parameters, for example 1, 2:0.5, 5:3 or 6:2x3
+ * @param text the operation text
+ * @param op   the operation to fill in
+ * @return True if the text names a valid operation and false otherwise
+ */
+bool parse_operation(string text, Operation& op)
+{
+    op = Operation{0, 1.0, 1, 1, 1};
+    string params;
+    size_t colon = text.find(':');
+    if (colon != string::npos)
+    {
+        params = text.substr(colon + 1);
+        text = text.substr(0, colon);
+    }
+
+    istringstream selection_stream(text);
+    if (!(selection_stream >> op.selection) || !selection_stream.eof() || op.selection < 1 || op.selection > 10)
+    {
+        return false;
+    }
+
+    istringstream param_stream(params);
+    char separator = 0;
+    if (op.selection == 2 || op.selection == 8 || op.selection == 9)
+    {
+        return (param_stream >> op.factor) && param_stream.eof();
+    }
+    if (op.selection == 5)
+    {
+        return (param_stream >> op.number) && param_stream.eof();
+    }
+    if (op.selection == 6)
+    {
+        return (param_stream >> op.x_scale >> separator >> op.y_scale) && separator == 'x' &&
+               param_stream.eof() && op.x_scale > 0 && op.y_scale > 0;
+    }
+    return params.empty();
+}
+
+/**
+ * Runs one operation on an image without prompting for parameters
+ * @param image the input image
+ * @param op    the operation to run
+ * @return the processed image
+ */
+vector<vector<Pixel>> apply_operation(const vector<vector<Pixel>>& image, const Operation& op)
+{
+    switch (op.selection)
+    {
+        case 1: return process_1(image);
+        case 2: return process_2(image, op.factor);
+        case 3: return process_3(image);
+        case 4: return process_4(image);
+        case 5: return process_5(image, op.number);
+        case 6: return process_6(image, op.x_scale, op.y_scale);
+        case 7: return process_7(image);
+        case 8: return process_8(image, op.factor);
+        case 9: return process_9(image, op.factor);
+        case 10: return process_10(image);
+    }
+    return image;
+}
+
 // perform image processing function 
 vector<vector<Pixel>> perform_image_processing(const vector<vector<Pixel>>& image, int selection) {
-    vector<vector<Pixel>> new_image;
+    Operation op = {selection, 1.0, 1, 1, 1};
     
         // proccess 1
          if (selection == 1) {
         cout << "Vignette selected"<< endl; 
-        new_image = process_1(image); 
             // process 2
     } else if (selection == 2) {
         cout << "Enter scaling factor"<< endl;
-        double scale;
-        cin >> scale;
-        new_image = process_2(image, scale);
-    } else if (selection == 3) {
-        new_image = process_3(image);
-    } else if (selection == 4) {
-        new_image = process_4(image);
+        cin >> op.factor;
     } else if (selection == 5) {
         cout << "Enter a mutiple of 90 degrees"<< endl;
-        int multiple;
-        cin >> multiple;
-        new_image = process_5(image,multiple);
+        cin >> op.number;
     } else if (selection == 6) {
         cout<< "Enter an x value to expand the width " << endl;
-        int x_factor;
-        int y_factor;
-        cin >> x_factor;
+        cin >> op.x_scale;
         cout << "Enter an y value to expand the height" << endl;
-        cin >> y_factor;  
-        new_image = process_6(image,x_factor,y_factor);
-    } else if (selection == 7) {
-        new_image = process_7(image);
+        cin >> op.y_scale;  
     } else if (selection == 8) {
         cout << "Enter a factor to lighten the image by"<< endl;
-        double lightening;
-        cin >> lightening;
-        new_image = process_8(image, lightening);
+        cin >> op.factor;
     } else if (selection == 9) {
         cout << "Enter a factor to darken the image by"<< endl;
-        double darkening;
-        cin >> darkening;
-        new_image = process_9(image, darkening);
-    } else if (selection == 10) {
-        new_image = process_10(image);
-    } else {
+        cin >> op.factor;
+    } else if (selection < 1 || selection > 10) {
         cout<<"invalid input"<<endl;
+        return {};
     }
 
-    
+    return apply_operation(image, op);
+}
 
-    return new_image;
+
+//***************************************************************************************************//
+//                                Memory planning                                  //
+//***************************************************************************************************//
+
+/**
+ * Parses a memory size such as 1048576, 512K, 256M or 2G
+ * @param text the size text
+ * @return the size in bytes, or -1 if the text is not a size
+ */
+long long parse_memory_size(string text)
+{
+    istringstream size_stream(text);
+    double value;
+    if (!(size_stream >> value) || value <= 0)
+    {
+        return -1;
+    }
+
+    string suffix;
+    size_stream >> suffix;
+    if (suffix == "K" || suffix == "k")
+    {
+        value = value * 1024;
+    }
+    else if (suffix == "M" || suffix == "m")
+    {
+        value = value * 1024 * 1024;
+    }
+    else if (suffix == "G" || suffix == "g")
+    {
+        value = value * 1024 * 1024 * 1024;
+    }
+    else if (!suffix.empty())
+    {
+        return -1;
+    }
+    return (long long)value;
+}
+
+/**
+ * Estimates the memory used by one decoded row
+ * @param width the row width in pixels
+ * @return the estimate in bytes
+ */
+long long estimate_row_memory(long long width)
+{
+    return width * sizeof(Pixel) + sizeof(vector<Pixel>);
+}
+
+/**
+ * Estimates the memory used by a decoded image
+ * @param width  the image width in pixels
+ * @param height the image height in pixels
+ * @return the estimate in bytes
+ */
+long long estimate_image_memory(long long width, long long height)
+{
+    return height * estimate_row_memory(width) + sizeof(vector<vector<Pixel>>);
+}
+
+/**
+ * Gets how many times process 5 calls process 4 for an operation
+ * @param op the operation
+ * @return the number of 90 degree rotations, 0 to 3
+ */
+int rotation_count(const Operation& op)
+{
+    if (op.selection == 4)
+    {
+        return 1;
+    }
+    if (op.selection != 5)
+    {
+        return 0;
+    }
+    // Matches the angle checks in process_5
+    int angle = op.number * 90;
+    if (angle % 360 == 0)
+    {
+        return 0;
+    }
+    if (angle % 360 == 90)
+    {
+        return 1;
+    }
+    if (angle % 360 == 180)
+    {
+        return 2;
+    }
+    return 3;
+}
+
+/**
+ * Gets the size of the image an operation produces
+ * @param op     the operation
+ * @param width  the input width, replaced with the output width
+ * @param height the input height, replaced with the output height
+ */
+void operation_output_size(const Operation& op, long long& width, long long& height)
+{
+    if (rotation_count(op) % 2 == 1)
+    {
+        swap(width, height);
+    }
+    else if (op.selection == 6)
+    {
+        width = width * op.x_scale;
+        height = height * op.y_scale;
+    }
 }
 
+/**
+ * Estimates the peak memory of running an operation chain on a whole image in memory
+ * @param width  the input width in pixels
+ * @param height the input height in pixels
+ * @param ops    the operation chain
+ * @return the estimate in bytes
+ */
+long long estimate_peak_memory(long long width, long long height, const vector<Operation>& ops)
+{
+    long long peak = estimate_image_memory(width, height);
+    for (const Operation& op : ops)
+    {
+        // The input stays alive until the result replaces it, and process 5
+        // keeps every intermediate rotation alive until it returns
+        long long step = estimate_image_memory(width, height);
+        int rotations = rotation_count(op);
+        if (rotations > 0)
+        {
+            for (int i = 0; i < rotations; i++)
+            {
+                swap(width, height);
+                step = step + estimate_image_memory(width, height);
+            }
+        }
+        else
+        {
+            operation_output_size(op, width, height);
+            step = step + estimate_image_memory(width, height);
+        }
+        peak = max(peak, step);
+    }
+    return peak;
+}
 
+/**
+ * Gets how many rows around a band an operation needs to read
+ * @param op the operation
+ * @return the number of extra rows needed above and below
+ */
+int operation_halo(const Operation& op)
+{
+    // The Sobel kernel of process 3 reads one row above and below
+    return op.selection == 3 ? 1 : 0;
+}
+
+/**
+ * Runs a row-local operation (anything but a rotation) on a range of rows of a larger image
+ * @param rows       the input rows, rows_first onwards, including any halo rows
+ * @param rows_first the image row of rows[0]
+ * @param first      the first image row to produce
+ * @param last       one past the last image row to produce
+ * @param total_rows the height of the whole image
+ * @param op         the operation, selection 0 copies the rows unchanged
+ * @return the processed rows for image rows first to last
+ */
+vector<vector<Pixel>> apply_operation_band(const vector<vector<Pixel>>& rows, int rows_first, int first, int last,
+                                           int total_rows, const Operation& op)
+{
+    switch (op.selection)
+    {
+        case 1: return process_1_rows(rows, rows_first, first, last, total_rows);
+        case 2: return process_2_rows(rows, rows_first, first, last, op.factor);
+        case 3: return process_3_rows(rows, rows_first, first, last, total_rows);
+        case 6: return process_6_rows(rows, rows_first, first, last, op.x_scale, op.y_scale);
+        case 7: return process_7_rows(rows, rows_first, first, last);
+        case 8: return process_8_rows(rows, rows_first, first, last, op.factor);
+        case 9: return process_9_rows(rows, rows_first, first, last, op.factor);
+        case 10: return process_10_rows(rows, rows_first, first, last);
+    }
+    return vector<vector<Pixel>>(rows.begin() + (first - rows_first), rows.begin() + (last - rows_first));
+}
+
+/**
+ * Gets how many rows of an image an operation can process at once within a memory budget
+ * @param op         the operation, a single rotation or a row-local operation
+ * @param width      the width of the image
+ * @param max_memory the memory budget in bytes
+ * @return the number of rows, less than 1 if not even one row fits
+ */
+long long banded_rows(const Operation& op, int width, long long max_memory)
+{
+    int halo = operation_halo(op);
+    long long in_row = estimate_row_memory(width);
+    long long out_per_row = in_row;
+    long long fixed = 2 * halo * in_row + in_row;
+    if (op.selection == 4)
+    {
+        // A band of b rows rotates into width rows of b pixels each
+        out_per_row = width * sizeof(Pixel);
+        fixed = fixed + width * sizeof(vector<Pixel>);
+    }
+    else if (op.selection == 6)
+    {
+        out_per_row = op.y_scale * estimate_row_memory((long long)width * op.x_scale);
+    }
+
+    // Band rows are copied once when halo rows are dropped, then processed
+    return (max_memory - fixed) / (2 * in_row + out_per_row);
+}
+
+/**
+ * Runs one operation from a rectangle of a BMP file into another BMP file a band of rows at a time.
+ * The source and destination must be different files, bands are read after earlier bands are written.
+ * @param source      the BMP file to read
+ * @param sx          left column of the rectangle to read
+ * @param sy          top row of the rectangle to read
+ * @param width       width of the rectangle
+ * @param height      height of the rectangle
+ * @param destination an existing BMP file large enough for the result
+ * @param dx          column of the destination to write the result at
+ * @param dy          row of the destination to write the result at
+ * @param op          the operation, a single rotation or a row-local operation
+ * @param max_memory  the memory budget in bytes
+ * @return True if successful and false otherwise
+ */
+bool run_operation_banded(string source, int sx, int sy, int width, int height,
+                          string destination, int dx, int dy, const Operation& op, long long max_memory)
+{
+    int halo = operation_halo(op);
+    long long band_rows = banded_rows(op, width, max_memory);
+    if (band_rows < 1)
+    {
+        return false;
+    }
+    band_rows = min(band_rows, (long long)height);
+
+    for (int first = 0; first < height; first = first + band_rows)
+    {
+        int last = min((long long)height, first + band_rows);
+        int band_first = max(0, first - halo);
+        int band_last = min(height, last + halo);
+
+        vector<vector<Pixel>> band = read_image_region(source, sx, sy + band_first, width, band_last - band_first);
+        if (band.empty())
+        {
+            return false;
+        }
+
+        bool success;
+        if (op.selection == 4)
+        {
+            // Image row r becomes destination column height - 1 - r
+            success = write_image_region(destination, process_4(band), dx + height - last, dy);
+        }
+        else
+        {
+            vector<vector<Pixel>> rows = apply_operation_band(band, band_first, first, last, height, op);
+            int y_scale = op.selection == 6 ? op.y_scale : 1;
+            success = write_image_region(destination, rows, dx, dy + first * y_scale);
+        }
+        if (!success)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs an operation chain from a rectangle of a BMP file into an output file without
+ * holding whole images in memory. Each operation streams bands of rows from one file
+ * into the next, using temporary spill files between operations. The output is only
+ * replaced once the whole chain has succeeded, so it may be the input itself.
+ * @param input      the BMP file to read
+ * @param x          left column of the rectangle to read
+ * @param y          top row of the rectangle to read
+ * @param width      width of the rectangle
+ * @param height     height of the rectangle
+ * @param ops        the operation chain
+ * @param output     the BMP file to write
+ * @param patch      True to save a copy of the input with the result at (x, y), false to save the result alone
+ * @param max_memory the memory budget in bytes
+ * @return True if successful and false otherwise
+ */
+bool run_chain_banded(string input, int x, int y, int width, int height, const vector<Operation>& ops,
+                      string output, bool patch, long long max_memory)
+{
+    // Rotations are run one quarter turn at a time
+    vector<Operation> steps;
+    for (const Operation& op : ops)
+    {
+        if (op.selection == 4 || op.selection == 5)
+        {
+            for (int i = 0; i < rotation_count(op); i++)
+            {
+                steps.push_back(Operation{4, 1.0, 1, 1, 1});
+            }
+        }
+        else
+        {
+            steps.push_back(op);
+        }
+    }
+    if (steps.empty())
+    {
+        steps.push_back(Operation{0, 1.0, 1, 1, 1});
+    }
+
+    // Check every step fits before any file is created
+    const Operation copy_rows = {0, 1.0, 1, 1, 1};
+    long long step_width = width;
+    long long step_height = height;
+    for (const Operation& step : steps)
+    {
+        if (banded_rows(step, step_width, max_memory) < 1)
+        {
+            cout << "Error: one row does not fit in the memory limit" << endl;
+            return false;
+        }
+        operation_output_size(step, step_width, step_height);
+        if (step_width > INT_MAX / 3 || step_height > INT_MAX)
+        {
+            cout << "Error: the processed image is too large" << endl;
+            return false;
+        }
+    }
+    if (patch && banded_rows(copy_rows, step_width, max_memory) < 1)
+    {
+        cout << "Error: one row does not fit in the memory limit" << endl;
+        return false;
+    }
+
+    // Every step writes a new spill file, so no step reads a file it is writing
+    string source = input;
+    step_width = width;
+    step_height = height;
+    bool success = true;
+    for (size_t i = 0; i < steps.size() && success; i++)
+    {
+        long long out_width = step_width;
+        long long out_height = step_height;
+        operation_output_size(steps[i], out_width, out_height);
+
+        string destination = output + ".spill" + to_string(i) + ".bmp";
+        success = create_blank_image(destination, out_width, out_height) &&
+                  run_operation_banded(source, i == 0 ? x : 0, i == 0 ? y : 0, step_width, step_height,
+                                       destination, 0, 0, steps[i], max_memory);
+
+        // Spill files are removed as soon as the next operation has read them
+        if (source != input)
+        {
+            remove(source.c_str());
+        }
+        source = destination;
+        step_width = out_width;
+        step_height = out_height;
+    }
+
+    if (success && !patch)
+    {
+        success = rename(source.c_str(), output.c_str()) == 0;
+    }
+    else if (success)
+    {
+        // Patch a copy of the input, or the input itself, from the last spill file
+        bool in_place = same_file(input, output);
+        string target = in_place ? input : output + ".patch.bmp";
+        success = (in_place || copy_file(input, target)) &&
+                  run_operation_banded(source, 0, 0, step_width, step_height, target, x, y, copy_rows, max_memory) &&
+                  (in_place || rename(target.c_str(), output.c_str()) == 0);
+        if (!success && !in_place)
+        {
+            remove(target.c_str());
+        }
+    }
+    remove(source.c_str());
+    return success;
+}
+
+
+//***************************************************************************************************//
+//                                Result cache                                  //
+//***************************************************************************************************//
+
+const unsigned long long XXH_PRIME_1 = 11400714785074694791ULL;
+const unsigned long long XXH_PRIME_2 = 14029467366897019727ULL;
+const unsigned long long XXH_PRIME_3 = 1609587929392839161ULL;
+const unsigned long long XXH_PRIME_4 = 9650029242287828579ULL;
+const unsigned long long XXH_PRIME_5 = 2870177450012600261ULL;
+
+/**
+ * Reads a little endian value from a byte array
+ * Helper function for hash_bytes()
+ * @param data  the bytes
+ * @param bytes the number of bytes to read, 4 or 8
+ * @return the value
+ */
+unsigned long long read_little_endian(const unsigned char* data, int bytes)
+{
+    unsigned long long result = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        result = (result << 8) | data[i];
+    }
+    return result;
+}
+
+unsigned long long rotate_left(unsigned long long value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+unsigned long long xxh_round(unsigned long long acc, unsigned long long input)
+{
+    acc = acc + input * XXH_PRIME_2;
+    return rotate_left(acc, 31) * XXH_PRIME_1;
+}
+
+unsigned long long xxh_merge(unsigned long long acc, unsigned long long value)
+{
+    acc = acc ^ xxh_round(0, value);
+    return acc * XXH_PRIME_1 + XXH_PRIME_4;
+}
+
+/**
+ * Hashes bytes with the 64-bit xxHash algorithm (XXH64)
+ * @param data   the bytes
+ * @param length the number of bytes
+ * @param seed   the seed, pass the previous hash to hash data in pieces
+ * @return the hash
+ */
+unsigned long long hash_bytes(const unsigned char* data, size_t length, unsigned long long seed)
+{
+    const unsigned char* end = data + length;
+    unsigned long long hash;
+
+    if (length >= 32)
+    {
+        unsigned long long v1 = seed + XXH_PRIME_1 + XXH_PRIME_2;
+        unsigned long long v2 = seed + XXH_PRIME_2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - XXH_PRIME_1;
+        while (end - data >= 32)
+        {
+            v1 = xxh_round(v1, read_little_endian(data, 8));
+            v2 = xxh_round(v2, read_little_endian(data + 8, 8));
+            v3 = xxh_round(v3, read_little_endian(data + 16, 8));
+            v4 = xxh_round(v4, read_little_endian(data + 24, 8));
+            data = data + 32;
+        }
+        hash = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12) + rotate_left(v4, 18);
+        hash = xxh_merge(hash, v1);
+        hash = xxh_merge(hash, v2);
+        hash = xxh_merge(hash, v3);
+        hash = xxh_merge(hash, v4);
+    }
+    else
+    {
+        hash = seed + XXH_PRIME_5;
+    }
+    hash = hash + length;
+
+    while (end - data >= 8)
+    {
+        hash = hash ^ xxh_round(0, read_little_endian(data, 8));
+        hash = rotate_left(hash, 27) * XXH_PRIME_1 + XXH_PRIME_4;
+        data = data + 8;
+    }
+    if (end - data >= 4)
+    {
+        hash = hash ^ (read_little_endian(data, 4) * XXH_PRIME_1);
+        hash = rotate_left(hash, 23) * XXH_PRIME_2 + XXH_PRIME_3;
+        data = data + 4;
+    }
+    while (data < end)
+    {
+        hash = hash ^ (*data * XXH_PRIME_5);
+        hash = rotate_left(hash, 11) * XXH_PRIME_1;
+        data++;
+    }
+
+    // Mix the final bits
+    hash = hash ^ (hash >> 33);
+    hash = hash * XXH_PRIME_2;
+    hash = hash ^ (hash >> 29);
+    hash = hash * XXH_PRIME_3;
+    return hash ^ (hash >> 32);
+}
+
+/**
+ * Hashes the pixel data of a BMP file, without decoding it
+ * @param filename BMP image filename
+ * @param hash     the hash of the image size and pixel array
+ * @return True if this is a valid image and false otherwise
+ */
+bool hash_pixel_data(string filename, unsigned long long& hash)
+{
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    BmpHeader header;
+    if (!read_bmp_header(stream, header))
+    {
+        return false;
+    }
+
+    // The same bytes are a different image when the row order or channel layout differs
+    string layout = to_string(header.width) + "x" + to_string(header.height) + "x" + to_string(header.bits_per_pixel) +
+                    (header.top_down ? "t" : "b") + to_string(header.red_byte) + to_string(header.green_byte) +
+                    to_string(header.blue_byte);
+    hash = hash_bytes((const unsigned char*)layout.data(), layout.size(), 0);
+
+    // Hash the pixel array a piece at a time, chaining each piece's hash into the next
+    long long remaining = (long long)(header.scanline_size + header.padding) * header.height;
+    vector<unsigned char> buffer(1 << 20);
+    stream.seekg(header.start);
+    while (remaining > 0)
+    {
+        stream.read((char*)buffer.data(), min(remaining, (long long)buffer.size()));
+        if (stream.gcount() <= 0)
+        {
+            return false;
+        }
+        hash = hash_bytes(buffer.data(), stream.gcount(), hash);
+        remaining = remaining - stream.gcount();
+    }
+    return true;
+}
+
+/**
+ * Writes an operation chain in a canonical form, so equal chains give equal text.
+ * Factors are written at full precision, and rotations as their number of quarter turns.
+ * @param ops the operations, in order
+ * @return the canonical text, for example 1;2:0.5;5:3;6:2x3
+ */
+string canonical_operations(const vector<Operation>& ops)
+{
+    ostringstream text;
+    text.precision(17);
+    for (const Operation& op : ops)
+    {
+        if (op.selection == 4 || op.selection == 5)
+        {
+            text << "5:" << rotation_count(op);
+        }
+        else
+        {
+            text << op.selection;
+            if (op.selection == 2 || op.selection == 8 || op.selection == 9)
+            {
+                text << ":" << op.factor;
+            }
+            else if (op.selection == 6)
+            {
+                text << ":" << op.x_scale << "x" << op.y_scale;
+            }
+        }
+        text << ";";
+    }
+    return text.str();
+}
+
+// On-disk cache of processed images, keyed by the input's pixel data and the
+// operation chain. Entries are files in the cache directory, served as copies
+// (reflinks where the filesystem supports them). The least recently used entries are
+// removed once the directory grows past its size limit.
+class ResultCache
+{
+public:
+    ResultCache(string directory, long long max_bytes)
+        : directory(directory), max_bytes(max_bytes), hits(0), misses(0), evictions(0)
+    {
+        mkdir(directory.c_str(), 0777);
+    }
+
+    /**
+     * Gets the cache key of processing an image
+     * @param input   the input BMP file
+     * @param options the operation chain and any other options that change the output
+     * @param key     the key
+     * @return True if the input could be hashed and false otherwise
+     */
+    bool make_key(string input, string options, string& key)
+    {
+        unsigned long long pixel_hash;
+        if (!hash_pixel_data(input, pixel_hash))
+        {
+            return false;
+        }
+        unsigned long long options_hash = hash_bytes((const unsigned char*)options.data(), options.size(), pixel_hash);
+
+        char text[40];
+        snprintf(text, sizeof(text), "%016llx%016llx", pixel_hash, options_hash);
+        key = text;
+        return true;
+    }
+
+    /**
+     * Serves a cached result as the output file, if there is one
+     * @param key    the cache key
+     * @param output the file to create
+     * @return True on a hit and false on a miss
+     */
+    bool lookup(string key, string output)
+    {
+        // A damaged or truncated entry is dropped and counted as a miss
+        string entry = entry_path(key);
+        fstream entry_stream;
+        entry_stream.open(entry, ios::in | ios::binary);
+        BmpHeader header;
+        if (!read_bmp_header(entry_stream, header))
+        {
+            if (entry_stream.is_open())
+            {
+                remove(entry.c_str());
+            }
+            misses++;
+            return false;
+        }
+        entry_stream.close();
+
+        // Hits are served as copies, never links, so later writes to the output cannot change
+        // the entry. The copy is renamed into place so the output is never left half written.
+        string temporary = output + ".cache" + to_string(getpid());
+        if (!clone_file(entry, temporary) || rename(temporary.c_str(), output.c_str()) != 0)
+        {
+            remove(temporary.c_str());
+            misses++;
+            return false;
+        }
+
+        // The modification time records when an entry was last used
+        utime(entry.c_str(), nullptr);
+        hits++;
+        return true;
+    }
+
+    /**
+     * Adds a finished output to the cache, then evicts old entries if the cache is too large
+     * @param key    the cache key
+     * @param output the output file to copy into the cache
+     */
+    void store(string key, string output)
+    {
+        // Entries are copies so later changes to the output cannot alter them,
+        // and are renamed into place so other processes never see a partial entry
+        string entry = entry_path(key);
+        string temporary = entry + ".tmp" + to_string(getpid());
+        if (clone_file(output, temporary))
+        {
+            chmod(temporary.c_str(), 0444);
+            rename(temporary.c_str(), entry.c_str());
+            utime(entry.c_str(), nullptr);
+        }
+        else
+        {
+            remove(temporary.c_str());
+        }
+        evict(key + ".bmp");
+    }
+
+    // Prints this run's counters and adds them to the totals kept in the cache directory
+    void report()
+    {
+        // Concurrent processes may overwrite each other's update, the totals are approximate
+        long long total_hits = 0, total_misses = 0, total_evictions = 0;
+        string stats_path = directory + "/stats";
+        ifstream in(stats_path);
+        string name;
+        long long value;
+        while (in >> name >> value)
+        {
+            if (name == "hits") total_hits = value;
+            if (name == "misses") total_misses = value;
+            if (name == "evictions") total_evictions = value;
+        }
+        in.close();
+
+        total_hits += hits;
+        total_misses += misses;
+        total_evictions += evictions;
+        string temporary = stats_path + ".tmp" + to_string(getpid());
+        ofstream out(temporary);
+        out << "hits " << total_hits << endl << "misses " << total_misses << endl << "evictions " << total_evictions << endl;
+        out.close();
+        rename(temporary.c_str(), stats_path.c_str());
+
+        cout << "Cache: " << hits << " hits, " << misses << " misses, " << evictions << " evictions ("
+             << total_hits << " hits, " << total_misses << " misses in total)" << endl;
+    }
+
+private:
+    // Copies a file, sharing its blocks instead where the filesystem can (btrfs, XFS)
+    bool clone_file(string source, string destination)
+    {
+#ifdef FICLONE
+        int in = open(source.c_str(), O_RDONLY);
+        int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        bool cloned = in >= 0 && out >= 0 && ioctl(out, FICLONE, in) == 0;
+        if (in >= 0) close(in);
+        if (out >= 0) close(out);
+        if (cloned)
+        {
+            return true;
+        }
+#endif
+        return copy_file(source, destination);
+    }
+
+    string entry_path(string key)
+    {
+        return directory + "/" + key + ".bmp";
+    }
+
+    // Removes the least recently used entries until the cache fits its size limit.
+    // The entry named newest is removed last, only if it cannot fit on its own.
+    void evict(string newest)
+    {
+        lock_guard<mutex> lock(evict_guard);
+
+        // Use times are compared to the nanosecond, so entries used within the same second keep their order
+        vector<pair<pair<long long, long long>, string>> entries;
+        long long total = 0;
+        for (const string& name : list_directory(directory))
+        {
+            struct stat info;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bmp") == 0 &&
+                stat((directory + "/" + name).c_str(), &info) == 0)
+            {
+                long long seconds = name == newest ? LLONG_MAX : (long long)info.st_mtim.tv_sec;
+                entries.push_back(make_pair(make_pair(seconds, (long long)info.st_mtim.tv_nsec), name));
+                total = total + info.st_size;
+            }
+        }
+
+        sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size() && total > max_bytes; i++)
+        {
+            string path = directory + "/" + entries[i].second;
+            struct stat info;
+            if (stat(path.c_str(), &info) == 0 && remove(path.c_str()) == 0)
+            {
+                total = total - info.st_size;
+                evictions++;
+            }
+        }
+    }
+
+    string directory;
+    long long max_bytes;
+    atomic<long long> hits;
+    atomic<long long> misses;
+    atomic<long long> evictions;
+    mutex evict_guard;
+};
+
+
+/**
+ * Runs an operation chain on an image
+ * @param image the input image
+ * @param ops   the operations, in order
+ * @return the processed image
+ */
+vector<vector<Pixel>> apply_operations(vector<vector<Pixel>> image, const vector<Operation>& ops)
+{
+    for (const Operation& op : ops)
+    {
+        image = apply_operation(image, op);
+    }
+    return image;
+}
+
+// Images with fewer pixels than this are processed whole by one worker
+const long long PARALLEL_MIN_PIXELS = 1 << 20;
+
+/**
+ * Runs an operation chain on an image using a worker pool. Row-local operations on
+ * large images are split into bands of rows that idle workers can steal; small
+ * images and rotations run whole on the calling worker. Called from outside the
+ * pool, the chain runs as one task on a worker.
+ * @param image the input image
+ * @param ops   the operations, in order
+ * @param pool  the workers to run bands on
+ * @return the processed image
+ */
+vector<vector<Pixel>> apply_operations_parallel(vector<vector<Pixel>> image, const vector<Operation>& ops,
+                                                WorkStealingPool& pool)
+{
+    // Bands go on the submitting worker's own queue for the others to steal. A caller
+    // outside the pool would deal them out round-robin instead, so hand the chain to a worker.
+    if (!pool.on_worker())
+    {
+        atomic<bool> done(false);
+        pool.submit([&] {
+            image = apply_operations_parallel(move(image), ops, pool);
+            done = true;
+        });
+        pool.help_until([&] { return done.load(); });
+        return image;
+    }
+
+    for (const Operation& op : ops)
+    {
+        int height = image.size();
+        if (op.selection == 4 || op.selection == 5 || (long long)height * image[0].size() < PARALLEL_MIN_PIXELS)
+        {
+            image = apply_operation(image, op);
+            continue;
+        }
+
+        // Several bands per worker, so a worker that finishes early has something to steal
+        int band_rows = (height + pool.size() * 4 - 1) / (pool.size() * 4);
+        vector<vector<vector<Pixel>>> bands((height + band_rows - 1) / band_rows);
+        atomic<int> pending(bands.size());
+
+        for (size_t k = 0; k < bands.size(); k++)
+        {
+            pool.submit([&, k] {
+                // Bands read the shared input in place, halo rows included
+                int first = k * band_rows;
+                int last = min(height, first + band_rows);
+                bands[k] = apply_operation_band(image, 0, first, last, height, op);
+                pending--;
+            });
+        }
+        pool.help_until([&] { return pending == 0; });
+
+        vector<vector<Pixel>> result;
+        for (vector<vector<Pixel>>& band : bands)
+        {
+            for (vector<Pixel>& row : band)
+            {
+                result.push_back(move(row));
+            }
+        }
+        image = move(result);
+    }
+    return image;
+}
+
+/**
+ * Prints how much work each worker of a pool did
+ * @param pool the pool
+ */
+void print_worker_stats(WorkStealingPool& pool)
+{
+    double elapsed = pool.elapsed_seconds();
+    vector<WorkerStats> stats = pool.stats();
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        cout << "Worker " << i << ": " << stats[i].tasks << " tasks (" << stats[i].stolen << " stolen), "
+             << int(100 * stats[i].busy_seconds / elapsed) << "% busy" << endl;
+    }
+}
+
+/**
+ * Runs an operation chain on many files as a three stage pipeline. A reader thread
+ * decodes upcoming files, a compute thread processes them and the calling thread saves
+ * them, so disk reads, filtering and disk writes overlap. The stages are connected by
+ * queues of queue_depth images, so memory stays bounded when one stage is slower.
+ * With a pool, the compute stage runs each file as a task on the pool instead.
+ * @param inputs      the BMP files to process
+ * @param output_dir  the directory to save each result in, under the input's file name
+ * @param ops         the operations, in order
+ * @param queue_depth the number of images each queue can hold
+ * @param pool        workers for the compute stage, or nullptr to use one thread
+ * @param cache       results of earlier runs, or nullptr to process every file
+ * @return the number of files that failed, or that would have been saved under the same name
+ */
+int run_batch(const vector<string>& inputs, string output_dir, const vector<Operation>& ops, int queue_depth,
+              WorkStealingPool* pool, ResultCache* cache)
+{
+    // Outputs are named after their input, so two inputs with the same name would overwrite each other
+    map<string, string> outputs;
+    int duplicates = 0;
+    for (const string& input : inputs)
+    {
+        string output = output_dir + "/" + input.substr(input.find_last_of('/') + 1);
+        if (!outputs.insert(make_pair(output, input)).second)
+        {
+            cout << "Error: " << outputs[output] << " and " << input << " would both be saved as " << output << endl;
+            duplicates++;
+        }
+    }
+    if (duplicates > 0)
+    {
+        return duplicates;
+    }
+
+    BoundedQueue<BatchItem> decoded(queue_depth);
+    BoundedQueue<BatchItem> processed(queue_depth);
+
+    thread reader([&] {
+        for (const string& input : inputs)
+        {
+            BatchItem item;
+            item.input = input;
+            item.output = output_dir + "/" + input.substr(input.find_last_of('/') + 1);
+            item.cached = false;
+
+            // Files served from the cache are passed along without being decoded.
+            // An output that is the input itself is never served, a hit would replace the input.
+            if (cache != nullptr && !same_file(input, item.output) &&
+                cache->make_key(input, canonical_operations(ops), item.cache_key))
+            {
+                item.cached = cache->lookup(item.cache_key, item.output);
+            }
+            if (!item.cached)
+            {
+                item.image = read_image(input);
+            }
+            if (!decoded.push(move(item)))
+            {
+                break;
+            }
+        }
+        decoded.close();
+    });
+
+    thread compute([&] {
+        BatchItem item;
+        if (pool == nullptr)
+        {
+            while (decoded.pop(item))
+            {
+                if (!item.image.empty())
+                {
+                    item.image = apply_operations(move(item.image), ops);
+                }
+                if (!processed.push(move(item)))
+                {
+                    break;
+                }
+            }
+            processed.close();
+            return;
+        }
+
+        // Each file is a task; limit how many are in flight so memory stays bounded
+        atomic<int> in_flight(0);
+        int limit = pool->size() + queue_depth;
+        while (decoded.pop(item))
+        {
+            pool->help_until([&] { return in_flight < limit; });
+            in_flight++;
+            shared_ptr<BatchItem> job = make_shared<BatchItem>(move(item));
+            pool->submit([&, job] {
+                if (!job->image.empty())
+                {
+                    job->image = apply_operations_parallel(move(job->image), ops, *pool);
+                }
+                processed.push(move(*job));
+                in_flight--;
+            });
+        }
+        pool->help_until([&] { return in_flight == 0; });
+        processed.close();
+    });
+
+    // The writer runs here and is the only stage that prints
+    int failures = 0;
+    BatchItem item;
+    while (processed.pop(item))
+    {
+        if (item.cached)
+        {
+            cout << "Served " << item.output << " from the cache" << endl;
+        }
+        else if (item.image.empty())
+        {
+            cout << "Error: could not read " << item.input << endl;
+            failures++;
+        }
+        else if (!write_image(item.output, item.image))
+        {
+            cout << "Error: could not write " << item.output << endl;
+            failures++;
+        }
+        else
+        {
+            cout << "Wrote " << item.output << endl;
+            if (!item.cache_key.empty())
+            {
+                cache->store(item.cache_key, item.output);
+            }
+        }
+    }
+
+    reader.join();
+    compute.join();
+    return failures;
+}
+
+
+//***************************************************************************************************//
+//                                Spool workers                                  //
+//***************************************************************************************************//
+
+// A job read from a descriptor file in the spool directory
+struct SpoolJob
+{
+    string input;
+    string output;
+    vector<Operation> ops;
+};
+
+/**
+ * Gets the name this process uses for itself in claim file names
+ * @return the host name and process id, for example archive3-4127
+ */
+string worker_name()
+{
+    char host[256] = {0};
+    gethostname(host, sizeof(host) - 1);
+    string name = string(host) + "-" + to_string(getpid());
+    replace(name.begin(), name.end(), '.', '_');
+    return name;
+}
+
+/**
+ * Reads a job descriptor. Each line is a key and a value:
+ *     input scans/a.bmp
+ *     output processed/a.bmp
+ *     op 2:0.5
+ * op lines are applied in order. Relative paths are relative to the spool directory.
+ * @param filename the descriptor file
+ * @param spool    the spool directory
+ * @param job      the job to fill in
+ * @param error    why the descriptor is invalid
+ * @return True if the descriptor is valid and false otherwise
+ */
+bool read_job(string filename, string spool, SpoolJob& job, string& error)
+{
+    ifstream in(filename);
+    if (!in.is_open())
+    {
+        error = "could not open the job descriptor";
+        return false;
+    }
+
+    string line;
+    while (getline(in, line))
+    {
+        istringstream line_stream(line);
+        string key, value;
+        if (!(line_stream >> key) || key[0] == '#')
+        {
+            continue;
+        }
+
+        // The value is the rest of the line, so paths may contain spaces
+        getline(line_stream >> ws, value);
+        if (!value.empty() && value[value.size() - 1] == '\r')
+        {
+            value.erase(value.size() - 1);
+        }
+
+        Operation op;
+        if (key == "input")
+        {
+            job.input = value;
+        }
+        else if (key == "output")
+        {
+            job.output = value;
+        }
+        else if (key == "op" && parse_operation(value, op))
+        {
+            job.ops.push_back(op);
+        }
+        else
+        {
+            error = "invalid line: " + line;
+            return false;
+        }
+    }
+
+    if (job.input.empty() || job.output.empty())
+    {
+        error = "the job needs an input and an output";
+        return false;
+    }
+    if (job.input[0] != '/')
+    {
+        job.input = spool + "/" + job.input;
+    }
+    if (job.output[0] != '/')
+    {
+        job.output = spool + "/" + job.output;
+    }
+    return true;
+}
+
+/**
+ * Adds a job to a spool directory. The descriptor is written under a hidden
+ * name and renamed into place, so workers never see a partial descriptor.
+ * @param spool  the spool directory
+ * @param input  the input BMP file
+ * @param output the output BMP file
+ * @param ops    the operations, in order
+ * @return the job name, or an empty string if it could not be written
+ */
+string submit_job(string spool, string input, string output, const vector<Operation>& ops)
+{
+    static int submitted = 0;
+    mkdir(spool.c_str(), 0777);
+    mkdir((spool + "/jobs").c_str(), 0777);
+
+    string name = to_string(time(nullptr)) + "-" + worker_name() + "-" + to_string(submitted++) + ".job";
+    // Paths given relative to where the job was submitted from are made absolute
+    char directory[4096];
+    if (getcwd(directory, sizeof(directory)) != nullptr)
+    {
+        if (input[0] != '/')
+        {
+            input = string(directory) + "/" + input;
+        }
+        if (output[0] != '/')
+        {
+            output = string(directory) + "/" + output;
+        }
+    }
+
+    string temporary = spool + "/jobs/." + name;
+    ofstream out(temporary);
+    out << "input " << input << endl << "output " << output << endl;
+    for (const Operation& op : ops)
+    {
+        // canonical_operations writes each operation followed by ;
+        string text = canonical_operations(vector<Operation>(1, op));
+        out << "op " << text.substr(0, text.size() - 1) << endl;
+    }
+    out.close();
+
+    if (out.fail() || rename(temporary.c_str(), (spool + "/jobs/" + name).c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        return "";
+    }
+    return name;
+}
+
+/**
+ * Returns claims whose lease has expired to the job queue. A claim's modification
+ * time is refreshed while its worker is alive, so an old claim means the worker died.
+ * Only one worker's rename can succeed for each claim.
+ * @param spool         the spool directory
+ * @param lease_seconds how long a claim lasts without being refreshed
+ */
+void reclaim_stale_jobs(string spool, int lease_seconds)
+{
+    time_t now = time(nullptr);
+    for (const string& name : list_directory(spool + "/claimed"))
+    {
+        // Claims are named job.worker, the job name ends in .job
+        string claim = spool + "/claimed/" + name;
+        size_t job_end = name.rfind(".job.");
+        struct stat info;
+        if (job_end == string::npos || stat(claim.c_str(), &info) != 0 || now - info.st_mtime < lease_seconds)
+        {
+            continue;
+        }
+        string job = name.substr(0, job_end + 4);
+        if (rename(claim.c_str(), (spool + "/jobs/" + job).c_str()) == 0)
+        {
+            cout << "Reclaimed " << job << " from " << name.substr(job_end + 5) << endl;
+        }
+    }
+}
+
+/**
+ * Runs one claimed job and moves its descriptor to done/ or failed/
+ * @param spool         the spool directory
+ * @param job_name      the job's descriptor name
+ * @param claim         the path of the claim file
+ * @param lease_seconds how long a claim lasts without being refreshed
+ * @param pool          workers for processing, or nullptr to use this thread
+ * @return True if the job succeeded and false otherwise
+ */
+bool run_spool_job(string spool, string job_name, string claim, int lease_seconds, WorkStealingPool* pool)
+{
+    // Keep the lease alive while the job runs
+    mutex heartbeat_guard;
+    condition_variable heartbeat_wake;
+    bool finished = false;
+    thread heartbeat([&] {
+        unique_lock<mutex> lock(heartbeat_guard);
+        while (!heartbeat_wake.wait_for(lock, chrono::seconds(max(1, lease_seconds / 3)), [&] { return finished; }))
+        {
+            utime(claim.c_str(), nullptr);
+        }
+    });
+
+    SpoolJob job;
+    string error;
+    if (read_job(claim, spool, job, error))
+    {
+        vector<vector<Pixel>> image = read_image(job.input);
+        if (image.empty())
+        {
+            error = "could not read " + job.input;
+        }
+        else
+        {
+            image = pool ? apply_operations_parallel(move(image), job.ops, *pool) : apply_operations(move(image), job.ops);
+
+            // Write under a temporary name, so a job run twice after a reclaim never leaves a partial output
+            string temporary = job.output + ".tmp" + worker_name();
+            if (!write_image(temporary, image) || rename(temporary.c_str(), job.output.c_str()) != 0)
+            {
+                remove(temporary.c_str());
+                error = "could not write " + job.output;
+            }
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(heartbeat_guard);
+        finished = true;
+    }
+    heartbeat_wake.notify_one();
+    heartbeat.join();
+
+    // If the claim was reclaimed while this worker was stalled, the job now belongs to another worker
+    string marker_dir = spool + (error.empty() ? "/done/" : "/failed/");
+    if (rename(claim.c_str(), (marker_dir + job_name).c_str()) != 0)
+    {
+        cout << "Lost the claim on " << job_name << ", leaving it to the worker that reclaimed it" << endl;
+        return false;
+    }
+    if (!error.empty())
+    {
+        ofstream marker(marker_dir + job_name + ".error");
+        marker << worker_name() << ": " << error << endl;
+        cout << "Failed " << job_name << ": " << error << endl;
+        return false;
+    }
+    cout << "Done " << job_name << endl;
+    return true;
+}
+
+/**
+ * Processes jobs from a spool directory shared by any number of worker processes,
+ * on one or many hosts. The directory holds:
+ *     jobs/     descriptors waiting to run
+ *     claimed/  descriptors being run, named job.worker
+ *     done/     descriptors of finished jobs
+ *     failed/   descriptors of failed jobs, each with a job.error file saying why
+ * A worker claims a job by renaming it from jobs/ to claimed/, which only one worker can do.
+ * @param spool         the spool directory
+ * @param lease_seconds how long a claim lasts without being refreshed before it is reclaimed
+ * @param idle_exit     seconds without any jobs before the worker exits, 0 to run forever
+ * @param pool          workers for processing, or nullptr to use this thread
+ * @return the number of jobs that failed
+ */
+int run_worker(string spool, int lease_seconds, int idle_exit, WorkStealingPool* pool)
+{
+    mkdir(spool.c_str(), 0777);
+    mkdir((spool + "/jobs").c_str(), 0777);
+    mkdir((spool + "/claimed").c_str(), 0777);
+    mkdir((spool + "/done").c_str(), 0777);
+    mkdir((spool + "/failed").c_str(), 0777);
+
+    string name = worker_name();
+    cout << "Worker " << name << " watching " << spool << endl;
+    int failures = 0;
+    time_t idle_since = time(nullptr);
+
+    while (idle_exit == 0 || time(nullptr) - idle_since < idle_exit)
+    {
+        reclaim_stale_jobs(spool, lease_seconds);
+
+        bool claimed = false;
+        for (const string& job_name : list_directory(spool + "/jobs"))
+        {
+            // Hidden names are descriptors still being written
+            if (job_name[0] == '.' || job_name.size() < 5 || job_name.compare(job_name.size() - 4, 4, ".job") != 0)
+            {
+                continue;
+            }
+            // rename() keeps the modification time, so the lease is started before the claim.
+            // Otherwise a job that waited longer than the lease would look expired once claimed.
+            string job = spool + "/jobs/" + job_name;
+            string claim = spool + "/claimed/" + job_name + "." + name;
+            if (utime(job.c_str(), nullptr) == 0 && rename(job.c_str(), claim.c_str()) == 0)
+            {
+                failures += run_spool_job(spool, job_name, claim, lease_seconds, pool) ? 0 : 1;
+                claimed = true;
+                break;
+            }
+        }
+
+        if (claimed)
+        {
+            idle_since = time(nullptr);
+        }
+        else
+        {
+            this_thread::sleep_for(chrono::milliseconds(500));
+        }
+    }
+    return failures;
+}
+
+
+/**
+ * Prints the command line usage
+ * @param program the name the program was run as
+ */
+void print_usage(string program)
+{
+    cout << "Usage: " << program << " [options] input.bmp output.bmp" << endl;
+    cout << "       " << program << " [options] --batch output_dir input.bmp..." << endl;
+    cout << "       " << program << " [options] --submit spool_dir input.bmp output.bmp" << endl;
+    cout << "       " << program << " [options] --worker spool_dir" << endl;
+    cout << "       " << program << "                      (interactive menu)" << endl;
+    cout << "Options:" << endl;
+    cout << "  --op N[:params]   Apply menu process N, may be repeated to chain processes" << endl;
+    cout << "                    e.g. --op 1, --op 2:0.5, --op 5:3, --op 6:2x3" << endl;
+    cout << "  --roi X,Y,W,H     Only read and process the rectangle at column X, row Y" << endl;
+    cout << "  --crop            With --roi, write only the processed rectangle" << endl;
+    cout << "  --max-memory SIZE Keep memory use under SIZE (e.g. 512M, 2G) by processing" << endl;
+    cout << "                    in bands of rows with temporary files when needed" << endl;
+    cout << "  --batch DIR       Process every input file, saving results in DIR" << endl;
+    cout << "  --queue-depth N   Images buffered between batch stages (default 2)" << endl;
+    cout << "  --jobs N          Process on N worker threads and print how busy each was" << endl;
+    cout << "  --cache-dir DIR   Reuse results of earlier runs on the same pixels and processes" << endl;
+    cout << "  --cache-size SIZE Limit the cache to SIZE, removing least recently used results (default 1G)" << endl;
+    cout << "  --submit DIR      Queue a job in spool directory DIR instead of running it" << endl;
+    cout << "  --worker DIR      Run jobs queued in spool directory DIR" << endl;
+    cout << "  --lease SECONDS   Reclaim jobs whose worker stopped responding this long ago (default 300)" << endl;
+    cout << "  --idle-exit SECONDS  Stop a worker after this long without jobs (default: never)" << endl;
+}
+
+/**
+ * Runs the processes named on the command line on one image
+ * @param argc argument count
+ * @param argv arguments
+ * @return the program exit status
+ */
+int run_command_line(int argc, char* argv[])
+{
+    vector<Operation> ops;
+    vector<string> files;
+    bool use_roi = false;
+    bool crop = false;
+    int roi_x = 0;
+    int roi_y = 0;
+    int roi_width = 0;
+    int roi_height = 0;
+    long long max_memory = 0;
+    string batch_dir;
+    int queue_depth = 2;
+    int jobs = 1;
+    string cache_dir;
+    long long cache_size = 1LL << 30;
+    string submit_dir;
+    string worker_dir;
+    int lease_seconds = 300;
+    int idle_exit = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--op" && i + 1 < argc)
+        {
+            Operation op;
+            if (!parse_operation(argv[++i], op))
+            {
+                cout << "Error: invalid operation " << argv[i] << endl;
+                return 1;
+            }
+            ops.push_back(op);
+        }
+        else if (arg == "--roi" && i + 1 < argc)
+        {
+            istringstream roi_stream(argv[++i]);
+            char c1 = 0, c2 = 0, c3 = 0;
+            if (!(roi_stream >> roi_x >> c1 >> roi_y >> c2 >> roi_width >> c3 >> roi_height) ||
+                c1 != ',' || c2 != ',' || c3 != ',')
+            {
+                cout << "Error: --roi expects X,Y,W,H" << endl;
+                return 1;
+            }
+            use_roi = true;
+        }
+        else if (arg == "--crop")
+        {
+            crop = true;
+        }
+        else if (arg == "--max-memory" && i + 1 < argc)
+        {
+            max_memory = parse_memory_size(argv[++i]);
+            if (max_memory < 0)
+            {
+                cout << "Error: invalid memory size " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            batch_dir = argv[++i];
+        }
+        else if (arg == "--queue-depth" && i + 1 < argc)
+        {
+            queue_depth = atoi(argv[++i]);
+            if (queue_depth < 1)
+            {
+                cout << "Error: --queue-depth must be at least 1" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--jobs" && i + 1 < argc)
+        {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1)
+            {
+                cout << "Error: --jobs must be at least 1" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--cache-dir" && i + 1 < argc)
+        {
+            cache_dir = argv[++i];
+        }
+        else if (arg == "--cache-size" && i + 1 < argc)
+        {
+            cache_size = parse_memory_size(argv[++i]);
+            if (cache_size < 0)
+            {
+                cout << "Error: invalid cache size " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--submit" && i + 1 < argc)
+        {
+            submit_dir = argv[++i];
+        }
+        else if (arg == "--worker" && i + 1 < argc)
+        {
+            worker_dir = argv[++i];
+        }
+        else if (arg == "--lease" && i + 1 < argc)
+        {
+            lease_seconds = atoi(argv[++i]);
+            if (lease_seconds < 1)
+            {
+                cout << "Error: --lease must be at least 1 second" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--idle-exit" && i + 1 < argc)
+        {
+            idle_exit = atoi(argv[++i]);
+        }
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            files.push_back(arg);
+        }
+    }
+
+    // Spool jobs only carry the input, output and operations
+    bool job_options = use_roi || crop || max_memory > 0 || !cache_dir.empty() || !batch_dir.empty();
+    if (!worker_dir.empty())
+    {
+        if (!files.empty() || !ops.empty() || job_options || !submit_dir.empty())
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        unique_ptr<WorkStealingPool> pool;
+        if (jobs > 1)
+        {
+            pool.reset(new WorkStealingPool(jobs));
+        }
+        return run_worker(worker_dir, lease_seconds, idle_exit, pool.get()) == 0 ? 0 : 1;
+    }
+
+    if (!submit_dir.empty())
+    {
+        if (files.size() != 2 || job_options || jobs > 1)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        string job = submit_job(submit_dir, files[0], files[1], ops);
+        if (job.empty())
+        {
+            cout << "Error: could not queue the job in " << submit_dir << endl;
+            return 1;
+        }
+        cout << "Queued " << job << endl;
+        return 0;
+    }
+
+    if (!batch_dir.empty())
+    {
+        if (files.empty())
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (use_roi || crop || max_memory > 0)
+        {
+            cout << "Error: " << (use_roi ? "--roi" : crop ? "--crop" : "--max-memory")
+                 << " cannot be combined with --batch" << endl;
+            return 1;
+        }
+        unique_ptr<WorkStealingPool> pool;
+        if (jobs > 1)
+        {
+            pool.reset(new WorkStealingPool(jobs));
+        }
+        unique_ptr<ResultCache> cache;
+        if (!cache_dir.empty())
+        {
+            cache.reset(new ResultCache(cache_dir, cache_size));
+        }
+        int failures = run_batch(files, batch_dir, ops, queue_depth, pool.get(), cache.get());
+        if (pool)
+        {
+            print_worker_stats(*pool);
+        }
+        if (cache)
+        {
+            cache->report();
+        }
+        return failures == 0 ? 0 : 1;
+    }
+
+    if (files.size() != 2 || (crop && !use_roi))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    string input = files[0];
+    string output = files[1];
+
+    // Plan from the header alone, before anything is decoded
+    fstream header_stream;
+    header_stream.open(input, ios::in | ios::binary);
+    BmpHeader header;
+    if (!read_bmp_header(header_stream, header))
+    {
+        cout << "Error: could not read " << input << endl;
+        return 1;
+    }
+    header_stream.close();
+
+    // Writing over the input is never cached, a hit would replace the input
+    unique_ptr<ResultCache> cache;
+    string cache_key;
+    if (!cache_dir.empty() && output != input && !same_file(input, output))
+    {
+        string options = canonical_operations(ops);
+        if (use_roi)
+        {
+            options += "roi=" + to_string(roi_x) + "," + to_string(roi_y) + "," + to_string(roi_width) + "," +
+                       to_string(roi_height) + (crop ? ",crop" : "");
+        }
+        cache.reset(new ResultCache(cache_dir, cache_size));
+        if (!cache->make_key(input, options, cache_key))
+        {
+            cache.reset();
+        }
+        else if (cache->lookup(cache_key, output))
+        {
+            cout << "Served " << output << " from the cache" << endl;
+            cache->report();
+            return 0;
+        }
+    }
+
+    if (!use_roi)
+    {
+        roi_width = header.width;
+        roi_height = header.height;
+    }
+
+    long long out_width = roi_width;
+    long long out_height = roi_height;
+    for (const Operation& op : ops)
+    {
+        operation_output_size(op, out_width, out_height);
+    }
+    if (use_roi && !crop && (out_width != roi_width || out_height != roi_height))
+    {
+        cout << "Error: the processes changed the region size, use --crop to save it" << endl;
+        return 1;
+    }
+
+    long long peak = estimate_peak_memory(roi_width, roi_height, ops);
+    bool success;
+    if (max_memory > 0 && peak > max_memory)
+    {
+        cout << "Estimated peak memory " << peak / 1024 << " KB exceeds the limit, processing in bands" << endl;
+        bool patch = use_roi && !crop;
+        success = run_chain_banded(input, roi_x, roi_y, roi_width, roi_height, ops, output, patch, max_memory);
+    }
+    else
+    {
+        vector<vector<Pixel>> image;
+        if (use_roi)
+        {
+            image = read_image_region(input, roi_x, roi_y, roi_width, roi_height);
+        }
+        else
+        {
+            image = read_image(input);
+        }
+        if (image.empty())
+        {
+            cout << "Error: could not read " << input << endl;
+            return 1;
+        }
+
+        if (jobs > 1)
+        {
+            WorkStealingPool pool(jobs);
+            image = apply_operations_parallel(move(image), ops, pool);
+            print_worker_stats(pool);
+        }
+        else
+        {
+            image = apply_operations(move(image), ops);
+        }
+
+        if (!use_roi || crop)
+        {
+            success = write_image(output, image);
+        }
+        else
+        {
+            // Start from the original file and patch only the rows of the region
+            success = (same_file(input, output) || copy_file(input, output)) &&
+                      write_image_region(output, image, roi_x, roi_y);
+        }
+    }
+
+    if (!success)
+    {
+        cout << "Error: Failed to write the processed image to a file." << endl;
+        return 1;
+    }
+    if (cache)
+    {
+        cache->store(cache_key, output);
+        cache->report();
+    }
+    return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+    // process files named on the command line without the menu
+    if (argc > 1) {
+        return run_command_line(argc, argv);
+    }
 
-int main()
-{   //UI
+    //UI
     cout << "CSPB 1300 Image Processing Application" << endl;
     cout << "Hello" << endl;
     // prompt the user for filenaem, automatically add the tag later, prevents filename errors